@@ -1,21 +1,91 @@
 #include "vm.c"
+#include <unistd.h>
+
+// How memory is reported before and after execution
+enum dump_mode { DUMP_FULL = 0, DUMP_TEXT, DUMP_BIN };
 
 int main(int argc, char **argv) {
-    initOS();
-    for (int i = 1; i < argc; i += 2) {
-        createProc(argv[i], argv[i+1]);
+    int opt;
+    enum dump_mode dump = DUMP_FULL;
+    char *diffFile = "memdiff.bin";
+    int loaders = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    bool verbose = false;
+    while ((opt = getopt(argc, argv, "c:t:d:o:j:v")) != -1) {
+        switch (opt) {
+        case 'c':   // Number of virtual CPUs
+            cpuCount = atoi(optarg);
+            if (cpuCount < 1 || cpuCount > MAX_CPUS) {
+                fprintf(stderr, "The number of CPUs must be between 1 and %d.\n", MAX_CPUS);
+                return 1;
+            }
+            break;
+        case 't':   // Record machine events and write them to a Chrome trace file
+            trace_start(optarg);
+            break;
+        case 'd':   // full: every nonzero word, text/bin: only the words that changed
+            if (strcmp(optarg, "full") == 0) dump = DUMP_FULL;
+            else if (strcmp(optarg, "text") == 0) dump = DUMP_TEXT;
+            else if (strcmp(optarg, "bin") == 0) dump = DUMP_BIN;
+            else {
+                fprintf(stderr, "Unknown dump mode %s, use full, text or bin.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':   // File for the binary memory diff
+            diffFile = optarg;
+            break;
+        case 'j':   // Number of threads reading program images at startup
+            loaders = atoi(optarg);
+            break;
+        case 'v':   // Report the startup time on stderr
+            verbose = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c cpus] [-t trace.json] [-d full|text|bin] [-o diff.bin] [-j loaders] [-v] code.obj heap.obj [code.obj heap.obj ...]\n", argv[0]);
+            return 1;
+        }
     }
 
-    fprintf(stdout, "Occupied memory after program load:\n");
-    fprintf_mem_nonzero(stdout, mem, UINT16_MAX);
-    uint16_t currentProc = 0;
-    loadProc(currentProc);
+    initOS();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int created = createProcs(argv + optind, (argc - optind) / 2, loaders < 1 ? 1 : loaders);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    if (verbose) fprintf(stderr, "Started %d processes in %.3f ms.\n", created, ms);
+
+    if (dump == DUMP_FULL) {
+        fprintf(stdout, "Occupied memory after program load:\n");
+        fprintf_mem_nonzero(stdout, mem, UINT16_MAX + 1);
+    }
+    else {
+        snapshotMem();
+    }
+    dispatch();
     fprintf_reg_all(stdout, reg, RCNT);
     fprintf(stdout, "program execution starts.\n");
-    run(argv[1], argv[2]);
+    run(argv[optind], argv[optind+1]);
     fprintf(stdout, "program execution ends.\n");
-    fprintf(stdout, "Occupied memory after program execution:\n");
-    fprintf_mem_nonzero(stdout, mem, UINT16_MAX);   
+    printExitRecords();
+    if (dump == DUMP_FULL) {
+        fprintf(stdout, "Occupied memory after program execution:\n");
+        fprintf_mem_nonzero(stdout, mem, UINT16_MAX + 1);   
+    }
+    else if (dump == DUMP_TEXT) {
+        fprintf(stdout, "Memory changed during program execution:\n");
+        fflush(stdout);
+        fprintf_mem_diff(stdout, mem, memSnapshot, changedFrames(), PAGE_SIZE_IN_WORDS);
+    }
+    else {
+        FILE *f = fopen(diffFile, "wb");
+        if (NULL == f) {
+            fprintf(stderr, "Cannot write to file %s\n", diffFile);
+            return 1;
+        }
+        fwrite_mem_diff(f, mem, memSnapshot, changedFrames(), PAGE_SIZE_IN_WORDS);
+        fclose(f);
+        fprintf(stdout, "Memory changes written to %s.\n", diffFile);
+    }
     fprintf_reg_all(stdout, reg, RCNT);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+Our goal is to read the data passed by the producer process.
+
+Attach the shared region 7 at VPN 10 with read-only access. Then try to receive a page at
+VPN 11, yielding until one arrives. Print the sender's pid, the first word of the received
+page and the first word of the shared region.
+*/
+
+uint16_t program[] = {        
+    /*mem[0x3000]=*/   0x2010,    //  0010 0000 0001 0000             LD R0,x10       ;load R0 with the key of the shared region
+    /*mem[0x3001]=*/   0x2210,    //  0010 0010 0001 0000             LD R1,x10       ;load R1 with the page and permissions to map it with
+    /*mem[0x3002]=*/   0xF02B,    //  1111 0000 0010 1011             SHM             ;map the shared region
+    /*mem[0x3003]=*/   0x200F,    //  0010 0000 0000 1111     RETRY   LD R0,xF        ;load R0 with the address to receive the page at
+    /*mem[0x3004]=*/   0xF02D,    //  1111 0000 0010 1101             RECV            ;receive a page, R0 is the sender or xFFFF
+    /*mem[0x3005]=*/   0x1020,    //  0001 0000 0010 0000             ADD R0,R0,x0    ;set the condition codes for R0
+    /*mem[0x3006]=*/   0x0602,    //  0000 0110 0000 0010             BRzp GOT        ;a page was received
+    /*mem[0x3007]=*/   0xF028,    //  1111 0000 0010 1000             YIELD           ;let the producer run
+    /*mem[0x3008]=*/   0x0FFA,    //  0000 1111 1111 1010             BRnzp RETRY     ;try again
+    /*mem[0x3009]=*/   0xF027,    //  1111 0000 0010 0111     GOT     OUTU16          ;print the sender's pid
+    /*mem[0x300A]=*/   0x2408,    //  0010 0100 0000 1000             LD R2,x8        ;load R2 with the address of the received page
+    /*mem[0x300B]=*/   0x6080,    //  0110 0000 1000 0000             LDR R0,R2,x0    ;load its first word
+    /*mem[0x300C]=*/   0xF027,    //  1111 0000 0010 0111             OUTU16          ;print it
+    /*mem[0x300D]=*/   0x2406,    //  0010 0100 0000 0110             LD R2,x6        ;load R2 with the address of the shared region
+    /*mem[0x300E]=*/   0x6080,    //  0110 0000 1000 0000             LDR R0,R2,x0    ;load its first word
+    /*mem[0x300F]=*/   0xF027,    //  1111 0000 0010 0111             OUTU16          ;print it
+    /*mem[0x3010]=*/   0xF025,    //  1111 0000 0010 0101             HALT            ;halt    
+    /*mem[0x3011]=*/   0x0007,    //  0000 0000 0000 0111             Key of the shared region
+    /*mem[0x3012]=*/   0x5002,    //  0101 0000 0000 0010             Map it at VPN 10 with read-only access
+    /*mem[0x3013]=*/   0x5800,    //  0101 1000 0000 0000             Address to receive the page at (VPN 11)
+    /*mem[0x3014]=*/   0x5000,    //  0101 0000 0000 0000             Address of the shared region
+};
+uint16_t heap[] = {
+    /* --memory-- */
+    /*mem[0x4000]=*/   0x0000,
+};
+
+int main(int argc, char** argv) {
+    char *outf = "programs/consumer_code.obj";
+    FILE *f = fopen(outf, "wb");
+    if (NULL==f) {
+        fprintf(stderr, "Cannot write to file %s\n", outf);
+    }
+    size_t writ = fwrite(program, sizeof(uint16_t), sizeof(program)/sizeof(uint16_t), f);
+    fprintf(stdout, "Written size_t=%lu to file %s\n", writ, outf);
+    fclose(f);
+
+
+    char *outff = "programs/consumer_heap.obj";
+    FILE *ff = fopen(outff, "wb");
+    if (NULL==ff) {
+        fprintf(stderr, "Cannot write to file %s\n", outff);
+    }
+    writ = fwrite(heap, sizeof(uint16_t), sizeof(heap)/sizeof(uint16_t), ff);
+    fprintf(stdout, "Written size_t=%lu to file %s\n", writ, outff);
+    fclose(ff);
+    return 0;
+}
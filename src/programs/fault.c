@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+Our goal is to crash. Load the address x6000, which lies in a page (VPN 12) that was
+never allocated, and read from it. The OS terminates this process only, so the HALT
+is never reached and the other processes keep running.
+*/
+
+uint16_t program[] = {        
+    /*mem[0x3000]=*/   0x5260,    //  0101 0010 0110 0000             AND R1,R1,x0    ;clear R1
+    /*mem[0x3001]=*/   0x1267,    //  0001 0010 0110 0111             ADD R1,R1,x7    ;load R1 with #7
+    /*mem[0x3002]=*/   0x2403,    //  0010 0100 0000 0011             LD R2,x3        ;load R2 with the address stored at x3006
+    /*mem[0x3003]=*/   0x6680,    //  0110 0110 1000 0000             LDR R3,R2,x0    ;read from the unallocated page, faults
+    /*mem[0x3004]=*/   0x1243,    //  0001 0010 0100 0011             ADD R1,R1,R3    ;never reached
+    /*mem[0x3005]=*/   0xF025,    //  1111 0000 0010 0101             HALT            ;halt    
+    /*mem[0x3006]=*/   0x6000,    //  0110 0000 0000 0000             Address inside the unallocated VPN 12
+};
+uint16_t heap[] = {
+    /* --memory-- */
+    /*mem[0x4000]=*/   0x0005, /* 5 */
+};
+
+int main(int argc, char** argv) {
+    char *outf = "programs/fault_code.obj";
+    FILE *f = fopen(outf, "wb");
+    if (NULL==f) {
+        fprintf(stderr, "Cannot write to file %s\n", outf);
+    }
+    size_t writ = fwrite(program, sizeof(uint16_t), sizeof(program)/sizeof(uint16_t), f);
+    fprintf(stdout, "Written size_t=%lu to file %s\n", writ, outf);
+    fclose(f);
+
+
+    char *outff = "programs/fault_heap.obj";
+    FILE *ff = fopen(outff, "wb");
+    if (NULL==ff) {
+        fprintf(stderr, "Cannot write to file %s\n", outff);
+    }
+    writ = fwrite(heap, sizeof(uint16_t), sizeof(heap)/sizeof(uint16_t), ff);
+    fprintf(stdout, "Written size_t=%lu to file %s\n", writ, outff);
+    fclose(ff);
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+Our goal is to pass data to the consumer process (pid 1) without copying it.
+
+Attach the shared region 7 at VPN 10 with read/write access and store 42 into it. Then store
+0x77 into the second heap page (VPN 9) and send that page to pid 1, which unmaps it from
+this process. Yield so that the consumer can run while the shared region is still mapped.
+*/
+
+uint16_t program[] = {        
+    /*mem[0x3000]=*/   0x200E,    //  0010 0000 0000 1110             LD R0,xE        ;load R0 with the key of the shared region
+    /*mem[0x3001]=*/   0x220E,    //  0010 0010 0000 1110             LD R1,xE        ;load R1 with the page and permissions to map it with
+    /*mem[0x3002]=*/   0xF02B,    //  1111 0000 0010 1011             SHM             ;map the shared region
+    /*mem[0x3003]=*/   0x240D,    //  0010 0100 0000 1101             LD R2,xD        ;load R2 with the address of the shared region
+    /*mem[0x3004]=*/   0x260D,    //  0010 0110 0000 1101             LD R3,xD        ;load R3 with #42
+    /*mem[0x3005]=*/   0x7680,    //  0111 0110 1000 0000             STR R3,R2,x0    ;store it into the shared region
+    /*mem[0x3006]=*/   0x240C,    //  0010 0100 0000 1100             LD R2,xC        ;load R2 with the address of the page to send
+    /*mem[0x3007]=*/   0x260C,    //  0010 0110 0000 1100             LD R3,xC        ;load R3 with x77
+    /*mem[0x3008]=*/   0x7680,    //  0111 0110 1000 0000             STR R3,R2,x0    ;store it into the page to send
+    /*mem[0x3009]=*/   0x5020,    //  0101 0000 0010 0000             AND R0,R0,x0    ;clear R0
+    /*mem[0x300A]=*/   0x1021,    //  0001 0000 0010 0001             ADD R0,R0,x1    ;send to pid 1
+    /*mem[0x300B]=*/   0x2207,    //  0010 0010 0000 0111             LD R1,x7        ;load R1 with the address of the page to send
+    /*mem[0x300C]=*/   0xF02C,    //  1111 0000 0010 1100             SEND            ;hand the page over to pid 1
+    /*mem[0x300D]=*/   0xF028,    //  1111 0000 0010 1000             YIELD           ;let the consumer run
+    /*mem[0x300E]=*/   0xF025,    //  1111 0000 0010 0101             HALT            ;halt    
+    /*mem[0x300F]=*/   0x0007,    //  0000 0000 0000 0111             Key of the shared region
+    /*mem[0x3010]=*/   0x5006,    //  0101 0000 0000 0110             Map it at VPN 10 with read/write access
+    /*mem[0x3011]=*/   0x5000,    //  0101 0000 0000 0000             Address of the shared region
+    /*mem[0x3012]=*/   0x002A,    //  0000 0000 0010 1010             #42
+    /*mem[0x3013]=*/   0x4800,    //  0100 1000 0000 0000             Address of the page to send
+    /*mem[0x3014]=*/   0x0077,    //  0000 0000 0111 0111             x77
+};
+uint16_t heap[] = {
+    /* --memory-- */
+    /*mem[0x4000]=*/   0x0000,
+};
+
+int main(int argc, char** argv) {
+    char *outf = "programs/producer_code.obj";
+    FILE *f = fopen(outf, "wb");
+    if (NULL==f) {
+        fprintf(stderr, "Cannot write to file %s\n", outf);
+    }
+    size_t writ = fwrite(program, sizeof(uint16_t), sizeof(program)/sizeof(uint16_t), f);
+    fprintf(stdout, "Written size_t=%lu to file %s\n", writ, outf);
+    fclose(f);
+
+
+    char *outff = "programs/producer_heap.obj";
+    FILE *ff = fopen(outff, "wb");
+    if (NULL==ff) {
+        fprintf(stderr, "Cannot write to file %s\n", outff);
+    }
+    writ = fwrite(heap, sizeof(uint16_t), sizeof(heap)/sizeof(uint16_t), ff);
+    fprintf(stdout, "Written size_t=%lu to file %s\n", writ, outff);
+    fclose(ff);
+    return 0;
+}
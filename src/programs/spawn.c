@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+Our goal is to create processes at runtime. The program spawns a copy of the simple program
+and prints the pid it got. It yields twice so that the child can finish, then spawns another
+copy, which reuses the PCB slot and the page table of the first child.
+
+The file names are stored in the heap, one character per word.
+*/
+
+uint16_t program[] = {        
+    /*mem[0x3000]=*/   0x200C,    //  0010 0000 0000 1100             LD R0,xC        ;load R0 with the address of the code file name
+    /*mem[0x3001]=*/   0x220C,    //  0010 0010 0000 1100             LD R1,xC        ;load R1 with the address of the heap file name
+    /*mem[0x3002]=*/   0xF02A,    //  1111 0000 0010 1010             SPAWN           ;create the child, its pid is returned in R0
+    /*mem[0x3003]=*/   0xF027,    //  1111 0000 0010 0111             OUTU16          ;print the pid of the child
+    /*mem[0x3004]=*/   0xF028,    //  1111 0000 0010 1000             YIELD           ;let the child run until its yield
+    /*mem[0x3005]=*/   0xF028,    //  1111 0000 0010 1000             YIELD           ;let the child halt
+    /*mem[0x3006]=*/   0x2006,    //  0010 0000 0000 0110             LD R0,x6        ;load R0 with the address of the code file name
+    /*mem[0x3007]=*/   0x2206,    //  0010 0010 0000 0110             LD R1,x6        ;load R1 with the address of the heap file name
+    /*mem[0x3008]=*/   0xF02A,    //  1111 0000 0010 1010             SPAWN           ;create the second child in the recycled slot
+    /*mem[0x3009]=*/   0xF027,    //  1111 0000 0010 0111             OUTU16          ;print the pid of the child
+    /*mem[0x300A]=*/   0xF028,    //  1111 0000 0010 1000             YIELD           ;let the child run until its yield
+    /*mem[0x300B]=*/   0xF028,    //  1111 0000 0010 1000             YIELD           ;let the child halt
+    /*mem[0x300C]=*/   0xF025,    //  1111 0000 0010 0101             HALT            ;halt    
+    /*mem[0x300D]=*/   0x4000,    //  0100 0000 0000 0000             HEAP address of the code file name
+    /*mem[0x300E]=*/   0x4020,    //  0100 0000 0010 0000             HEAP address of the heap file name
+};
+
+char *code_name = "programs/simple_code.obj";   /* mem[0x4000] */
+char *heap_name = "programs/simple_heap.obj";   /* mem[0x4020] */
+uint16_t heap[0x40] = {0};
+
+int main(int argc, char** argv) {
+    for (size_t i = 0; i < strlen(code_name); i++) heap[i] = code_name[i];
+    for (size_t i = 0; i < strlen(heap_name); i++) heap[0x20 + i] = heap_name[i];
+
+    char *outf = "programs/spawn_code.obj";
+    FILE *f = fopen(outf, "wb");
+    if (NULL==f) {
+        fprintf(stderr, "Cannot write to file %s\n", outf);
+    }
+    size_t writ = fwrite(program, sizeof(uint16_t), sizeof(program)/sizeof(uint16_t), f);
+    fprintf(stdout, "Written size_t=%lu to file %s\n", writ, outf);
+    fclose(f);
+
+
+    char *outff = "programs/spawn_heap.obj";
+    FILE *ff = fopen(outff, "wb");
+    if (NULL==ff) {
+        fprintf(stderr, "Cannot write to file %s\n", outff);
+    }
+    writ = fwrite(heap, sizeof(uint16_t), sizeof(heap)/sizeof(uint16_t), ff);
+    fprintf(stdout, "Written size_t=%lu to file %s\n", writ, outff);
+    fclose(ff);
+    return 0;
+}
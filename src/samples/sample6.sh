@@ -0,0 +1,4 @@
+#!/bin/sh
+
+# A process that spawns two copies of the simple program one after the other
+./vm programs/spawn_code.obj programs/spawn_heap.obj
\ No newline at end of file
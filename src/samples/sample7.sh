@@ -0,0 +1,4 @@
+#!/bin/sh
+
+# A producer that shares a region with a consumer and sends it a page
+./vm programs/producer_code.obj programs/producer_heap.obj programs/consumer_code.obj programs/consumer_heap.obj
\ No newline at end of file
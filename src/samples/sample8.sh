@@ -0,0 +1,4 @@
+#!/bin/sh
+
+# A process that reads from an unallocated page next to Sample1, which still runs to completion
+./vm programs/simple_code.obj programs/simple_heap.obj programs/fault_code.obj programs/fault_heap.obj
\ No newline at end of file
@@ -0,0 +1,4 @@
+#!/bin/sh
+
+# Seven copies of the brk program use up every page frame, so the last frame gets freed and cleared too
+./vm programs/brk_code.obj programs/brk_heap.obj programs/brk_code.obj programs/brk_heap.obj programs/brk_code.obj programs/brk_heap.obj programs/brk_code.obj programs/brk_heap.obj programs/brk_code.obj programs/brk_heap.obj programs/brk_code.obj programs/brk_heap.obj programs/brk_code.obj programs/brk_heap.obj
\ No newline at end of file
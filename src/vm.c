@@ -1,9 +1,13 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "vm_dbg.h"
+#include "vm_trace.h"
 
 #define NOPS (16)
 
@@ -26,9 +30,10 @@
 
 // OS bookkeeping constants
 #define PAGE_SIZE       (4096)  // Page size in bytes
+#define PAGE_SIZE_IN_WORDS (PAGE_SIZE / 2)
 #define OS_MEM_SIZE     (2)     // OS Region size. Also the start of the page tables' page
 #define Cur_Proc_ID     (0)     // id of the current process
-#define Proc_Count      (1)     // total number of processes, including ones that finished executing.
+#define Proc_Count      (1)     // PCB slots ever handed out. Freed slots are reused before this grows.
 #define OS_STATUS       (2)     // Bit 0 shows whether the PCB list is full or not
 #define OS_FREE_BITMAP  (3)     // Bitmap for free pages
 
@@ -41,7 +46,11 @@
 #define CODE_SIZE       (2)  // Number of pages for the code segment
 #define HEAP_INIT_SIZE  (2)  // Number of pages for the heap segment initially
 
-bool running = true;
+// State that every virtual CPU has a copy of. mem[] and the OS structures are shared.
+#define CPU_LOCAL _Thread_local
+#define MAX_CPUS (16)
+
+CPU_LOCAL bool running = true;
 
 typedef void (*op_ex_f)(uint16_t i);
 typedef void (*trp_ex_f)();
@@ -50,36 +59,78 @@ enum { trp_offset = 0x20 };
 enum regist { R0 = 0, R1, R2, R3, R4, R5, R6, R7, RPC, RCND, PTBR, RCNT };
 enum flags { FP = 1 << 0, FZ = 1 << 1, FN = 1 << 2 };
 
-uint16_t mem[UINT16_MAX] = {0};
-uint16_t reg[RCNT] = {0};
+uint16_t mem[UINT16_MAX + 1] = {0};  // 32 frames of PAGE_SIZE_IN_WORDS words
+CPU_LOCAL uint16_t reg[RCNT] = {0};
 uint16_t PC_START = 0x3000;
 
+/*
+  Virtual CPUs. Each one is a host thread with its own registers, page map and current
+  process, running processes from its own run queue and stealing from the others when
+  that is empty. CPU 0 is the thread that calls run().
+*/
+int cpuCount = 1;
+CPU_LOCAL int cpuId = 0;
+CPU_LOCAL uint16_t curPid = 0;
+
 void initOS();
 int createProc(char *fname, char *hname);
+uint16_t startProc(char *fname, char *hname);
+int createProcs(char **names, int count, int loaders);
 void loadProc(uint16_t pid);
 uint16_t allocMem(uint16_t ptbr, uint16_t vpn, uint16_t read, uint16_t write);  // Can use 'bool' instead
+uint16_t allocMemLocked(uint16_t ptbr, uint16_t vpn, uint16_t read, uint16_t write);
 int freeMem(uint16_t ptr, uint16_t ptbr);
+int freeMemLocked(uint16_t ptr, uint16_t ptbr);
+void reapFault();
+bool cpuIdle();
+void startZeroer();
+void stopZeroer();
 static inline uint16_t mr(uint16_t address);
 static inline void mw(uint16_t address, uint16_t val);
 static inline void tbrk();
 static inline void thalt();
 static inline void tyld();
+static inline void tspawn();
+static inline void tshm();
+static inline void tsend();
+static inline void trecv();
+void tshmLocked(uint16_t key, uint16_t vpn, uint16_t perm);
+void tsendLocked();
+void trecvLocked();
 static inline void trap(uint16_t i);
 
 static inline uint16_t sext(uint16_t n, int b) { return ((n >> (b - 1)) & 1) ? (n | (0xFFFF << b)) : n; }
+
+/*
+  Condition codes are evaluated lazily. uf() only records the last result and
+  reg[RCND] is materialized by cnd() when something actually reads it (BR, a
+  context switch or halt). Build with -DEAGER_CC to set reg[RCND] in uf() like
+  before; 'make check' compares the sample output of both builds.
+*/
+CPU_LOCAL uint16_t cnd_val = 0;       // Last value written to a register by an ALU/load instruction
+CPU_LOCAL bool cnd_pending = false;   // True if cnd_val has not been folded into reg[RCND] yet
+
+static inline uint16_t flags_of(uint16_t v) { return (v == 0) ? FZ : ((v >> 15) ? FN : FP); }
+#ifdef EAGER_CC
+static inline void uf(enum regist r) { reg[RCND] = flags_of(reg[r]); }
+static inline void cnd() {}
+#else
 static inline void uf(enum regist r) {
-    if (reg[r] == 0)
-        reg[RCND] = FZ;
-    else if (reg[r] >> 15)
-        reg[RCND] = FN;
-    else
-        reg[RCND] = FP;
+    cnd_val = reg[r];
+    cnd_pending = true;
+}
+static inline void cnd() {
+    if (cnd_pending) {
+        reg[RCND] = flags_of(cnd_val);
+        cnd_pending = false;
+    }
 }
+#endif
 static inline void add(uint16_t i)  { reg[DR(i)] = reg[SR1(i)] + (FIMM(i) ? SEXTIMM(i) : reg[SR2(i)]); uf(DR(i)); }
 static inline void and(uint16_t i)  { reg[DR(i)] = reg[SR1(i)] & (FIMM(i) ? SEXTIMM(i) : reg[SR2(i)]); uf(DR(i)); }
 static inline void ldi(uint16_t i)  { reg[DR(i)] = mr(mr(reg[RPC]+POFF9(i))); uf(DR(i)); }
 static inline void not(uint16_t i)  { reg[DR(i)]=~reg[SR1(i)]; uf(DR(i)); }
-static inline void br(uint16_t i)   { if (reg[RCND] & FCND(i)) { reg[RPC] += POFF9(i); } }
+static inline void br(uint16_t i)   { cnd(); if (reg[RCND] & FCND(i)) { reg[RPC] += POFF9(i); } }
 static inline void jsr(uint16_t i)  { reg[R7] = reg[RPC]; reg[RPC] = (FL(i)) ? reg[RPC] + POFF11(i) : reg[BR(i)]; }
 static inline void jmp(uint16_t i)  { reg[RPC] = reg[BR(i)]; }
 static inline void ld(uint16_t i)   { reg[DR(i)] = mr(reg[RPC] + POFF9(i)); uf(DR(i)); }
@@ -104,8 +155,8 @@ static inline void tputsp()   { /* Not Implemented */ }
 static inline void tinu16()   { fscanf(stdin, "%hu", &reg[R0]); }
 static inline void toutu16()  { fprintf(stdout, "%hu\n", reg[R0]); }
 
-trp_ex_f trp_ex[10] = {tgetc, tout, tputs, tin, tputsp, thalt, tinu16, toutu16, tyld, tbrk};
-static inline void trap(uint16_t i) { trp_ex[TRP(i) - trp_offset](); }
+trp_ex_f trp_ex[14] = {tgetc, tout, tputs, tin, tputsp, thalt, tinu16, toutu16, tyld, tbrk, tspawn, tshm, tsend, trecv};
+static inline void trap(uint16_t i) { trace_event(TRACE_TRAP, cpuId, curPid, TRP(i), 0); trp_ex[TRP(i) - trp_offset](); }
 op_ex_f op_ex[NOPS] = {/*0*/ br, add, ld, st, jsr, and, ldr, str, rti, not, ldi, sti, jmp, res, lea, trap};
 
 /**
@@ -121,20 +172,43 @@ void ld_img(char *fname, uint16_t *offsets, uint16_t size) {
         exit(1);
     }
 
-    for (uint16_t s = 0; s < size; s += PAGE_SIZE) {
-        uint16_t *p = mem + offsets[s / PAGE_SIZE];
-        uint16_t writeSize = (size - s) > PAGE_SIZE ? PAGE_SIZE : (size - s);
+    for (uint16_t s = 0; s < size; s += PAGE_SIZE_IN_WORDS) {
+        uint16_t *p = mem + offsets[s / PAGE_SIZE_IN_WORDS];
+        uint16_t writeSize = (size - s) > PAGE_SIZE_IN_WORDS ? PAGE_SIZE_IN_WORDS : (size - s);
         fread(p, sizeof(uint16_t), (writeSize), in);
     }
     
     fclose(in);
 }
 
+void cpuLoop() {
+  // A fault or an empty run queue stops the inner loop; cpuIdle() decides whether to carry on
+  do {
+    while (running) {
+      uint16_t i = mr(reg[RPC]++);
+      op_ex[OPC(i)](i);
+    }
+  } while (cpuIdle());
+}
+
+void *cpuThread(void *arg) {
+  cpuId = (int)(intptr_t)arg;
+  running = false;
+  cpuLoop();
+  return NULL;
+}
+
 void run(char *code, char *heap) {
-  while (running) {
-    uint16_t i = mr(reg[RPC]++);
-    op_ex[OPC(i)](i);
+  pthread_t cpus[MAX_CPUS];
+  startZeroer();
+  for (int i = 1; i < cpuCount; i++) {
+    pthread_create(&cpus[i], NULL, cpuThread, (void *)(intptr_t)i);
   }
+  cpuLoop();
+  for (int i = 1; i < cpuCount; i++) {
+    pthread_join(cpus[i], NULL);
+  }
+  stopZeroer();
 }
 
 // YOUR CODE STARTS HERE
@@ -158,17 +232,145 @@ void run(char *code, char *heap) {
 // Additional process creation definitions
 #define CODE_VPN_START (6)
 #define HEAP_VPN_START (8)
-#define MAX_PROCESS_NUM (4084/PCB_SIZE)
-#define PAGE_SIZE_IN_WORDS (PAGE_SIZE / 2)
+#define MAX_PAGE_TABLES (PAGE_SIZE_IN_WORDS / PAGE_TABLE_SIZE_IN_WORDS)  // Page tables that fit in the page table page, also the PCB slot limit
+// PCB slot recycling. Free slots are linked through their PC_PCB field.
+#define Live_Proc_Count (5)   // Number of processes that have not terminated yet
+#define Free_PCB_Head   (6)   // First free PCB slot, INVALID_PID if none
+#define MAX_FILE_NAME   (256) // Longest file name accepted by the spawn trap
+// Additional definitions for shared memory and messages
+#define FRAME_COUNT     (32)  // Number of page frames, one bit each in the bitmap
+#define MAX_SHM_REGIONS (8)   // Named shared regions that can exist at the same time
+#define MAILBOX_SIZE    (8)   // Pending messages per process
 // Additional definitions for mr and mw methods
 #define VPN_SHIFT (11)
 #define NOT_RESERVED_START_VPN (0x06)
-#define SEG_FAULT_OUTPUT (0xFFFF)
+#define SEG_FAULT_OUTPUT (0x0000)  // Decodes as a never taken BR, so a faulting fetch is a no-op
 // Additional definitions for tyld and tbrk
 #define INVALID_PID (UINT16_MAX)
 
+/*
+  Resolved page map of the running process. Entry vpn points at the host copy of
+  the page frame if the page is valid and readable (rmap) or writable (wmap), NULL
+  otherwise. It is rebuilt in loadProc() and patched by allocMem()/freeMem(), so
+  mr()/mw() never touch the page table words in mem[]. Reserved VPNs stay NULL.
+*/
+CPU_LOCAL uint16_t *rmap[PAGE_TABLE_SIZE_IN_WORDS] = {NULL};
+CPU_LOCAL uint16_t *wmap[PAGE_TABLE_SIZE_IN_WORDS] = {NULL};
+
+/*
+  Exit records in the order the processes terminated. They are kept apart from the
+  PCB slots, which get recycled, and printed by printExitRecords() after the run.
+*/
+#define EXIT_LOG_SIZE (256)  // Records kept, later exits are only counted
+
+enum exit_status { EXIT_NONE = 0, EXIT_HALTED, EXIT_FAULTED };
+enum fault_type { FAULT_NONE = 0, FAULT_RESERVED, FAULT_FREE_SPACE, FAULT_READ, FAULT_WRITE };
+static const char *faultNames[] = {"none", "reserved region", "free space", "read from a write-only page", "write to a read-only page"};
+
+struct exit_record {
+  uint16_t pid;
+  uint16_t status;  // enum exit_status
+  uint16_t fault;   // enum fault_type
+  uint16_t address; // Virtual address that faulted
+  uint16_t pc;      // Address of the faulting instruction
+};
+
+struct exit_record exitRecords[EXIT_LOG_SIZE] = {{0}};
+int exitCount = 0;                    // Processes that terminated, guarded by procLock
+CPU_LOCAL struct exit_record faultRecord = {0};  // Fault of the running process, filled by handleSegFault
+CPU_LOCAL bool faultPending = false;  // Set by handleSegFault, cleared once the process is reaped
+
+// Number of PTEs referring to each page frame. A frame goes back to the bitmap when it drops to 0.
+uint8_t frameRefs[FRAME_COUNT] = {0};
+
+// Named shared regions, one page each. A region disappears with the last mapping of its frame.
+struct shm_region {
+  bool used;
+  uint16_t key;
+  uint16_t pfn;
+};
+
+struct shm_region shmRegions[MAX_SHM_REGIONS] = {{0}};
+
+// A page in flight between two processes. The frame is owned by the message until it is received.
+struct message {
+  uint16_t sender;
+  uint16_t pfn;
+  uint16_t perm;    // READ_BIT and WRITE_BIT of the sender's PTE
+};
+
+struct mailbox {
+  uint16_t head;
+  uint16_t count;
+  struct message msgs[MAILBOX_SIZE];
+};
+
+struct mailbox mailboxes[MAX_PAGE_TABLES] = {{0}};
+
+/*
+  Locks shared by the CPUs. frameLock guards the bitmap, frameRefs and shmRegions;
+  procLock guards the PCB list, page tables of other processes, mailboxes and exit
+  records. procLock is always taken before frameLock. Functions ending in Locked
+  expect the caller to hold the lock and never take it again.
+*/
+pthread_mutex_t frameLock;
+pthread_mutex_t procLock;
+
+// Ready processes of one CPU, oldest first
+struct run_queue {
+  pthread_mutex_t lock;
+  uint16_t head;
+  uint16_t count;
+  uint16_t pids[MAX_PAGE_TABLES];
+};
+
+struct run_queue runQueues[MAX_CPUS];
+int nextQueue = 0;  // Queue that gets the next created process, guarded by procLock
+
+/*
+  Idle CPUs sleep on workReady until a process is queued or the last one exits.
+  readyProcs counts the queued processes over all run queues and idleCpus the
+  sleeping CPUs, so enqueueProc() only takes idleLock when someone is waiting.
+*/
+pthread_mutex_t idleLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t workReady = PTHREAD_COND_INITIALIZER;
+int readyProcs = 0;
+int idleCpus = 0;
+
+/*
+  Pre-zeroed frame pool. zeroedFrames uses the bitmap's layout and marks the free
+  frames that are known to hold only zeros. Freed frames are dirty until the zeroer
+  thread clears them, lowest PFN first. allocMem() still always takes the lowest free
+  frame, so the pool never changes which frame a process gets; it only saves the
+  inline clear when the zeroer got there first. The zeroer claims a frame in
+  zeroingFrames and clears it without frameLock; allocMem() waits on frameZeroed
+  if it wants that frame. The bitmap is left alone, so free page counts do not
+  depend on the zeroer either. Guarded by frameLock.
+*/
+uint32_t zeroedFrames = 0;
+uint32_t zeroingFrames = 0;
+pthread_cond_t zeroerWake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t frameZeroed = PTHREAD_COND_INITIALIZER;
+pthread_t zeroer;
+bool zeroerStop = false;
+
+/*
+  Frames written since the memory snapshot, in the bitmap's layout. The write map only
+  points at dirty frames, so the first store to a clean frame takes the mw() slow path
+  and marks it; later stores are as fast as before. allocMem() and the zeroer mark the
+  frames they fill. The OS frames are always part of a diff.
+*/
+#define FRAME_BIT(pfn) ((uint32_t)1 << (31 - (pfn)))
+#define OS_FRAMES (FRAME_BIT(0) | FRAME_BIT(1) | FRAME_BIT(2))
+
+uint32_t dirtyFrames = 0;
+uint16_t memSnapshot[UINT16_MAX + 1];
+
+static inline bool frameDirty(uint16_t pfn) { return __atomic_load_n(&dirtyFrames, __ATOMIC_RELAXED) & FRAME_BIT(pfn); }
+static inline void markDirty(uint16_t pfn) { __atomic_fetch_or(&dirtyFrames, FRAME_BIT(pfn), __ATOMIC_RELAXED); }
+
 /* HELPER FUNCTIONS */
-// Check if there are enough free pages in memory for the given number of pages
+// Check if there are enough free pages in memory for the given number of pages. Needs frameLock.
 bool checkFreePages(int requiredPages) {
   uint32_t bitmap = GET_BITMAP();
   int freePages = 0;
@@ -195,17 +397,154 @@ uint16_t allocatePageTable(uint16_t pid) {
   return ptb;
 }
 
-// Free allocated resources in case of allocation failure in createProc
+// Free allocated resources in case of allocation failure in createProc. Needs frameLock.
 void freeAllocatedResources(uint16_t pageTableBase, uint16_t startVPN, uint16_t endVPN) {
   for (uint16_t vpn = startVPN; vpn <= endVPN; vpn++) {
-    freeMem(vpn, pageTableBase); 
+    freeMemLocked(vpn, pageTableBase); 
   }
 }
 
-void handleSegFault(char* msg) {
+/*
+  Record a fault of the current process and stop the run loop so that reapFault()
+  terminates it once the faulting instruction is done. Accesses made by the rest of
+  that instruction fault again and are ignored.
+*/
+void handleSegFault(char* msg, uint16_t fault, uint16_t address) {
+  if (faultPending) return;
+
   printf("%s\n", msg);
+  trace_event(TRACE_FAULT, cpuId, curPid, fault, address);
+  faultRecord.fault = fault;
+  faultRecord.address = address;
+  faultRecord.pc = reg[RPC] - 1;   // PC was already incremented past the faulting instruction
+
+  faultPending = true;
   running = false;
-  exit(1);  // Terminate the simulation for good
+}
+
+// Refresh the page map entry for vpn from the page table at ptbr, if ptbr is the running process'
+void updatePageMap(uint16_t ptbr, uint16_t vpn) {
+  if (ptbr != reg[PTBR] || vpn < NOT_RESERVED_START_VPN) return;
+
+  uint16_t pte = mem[ptbr + vpn];
+  uint16_t pfn = (pte >> PFN_SHIFT) & PFN_MASK;
+  uint16_t *frame = mem + pfn * PAGE_SIZE_IN_WORDS;
+  rmap[vpn] = ((pte & VALID_BIT) && (pte & READ_BIT)) ? frame : NULL;
+  wmap[vpn] = ((pte & VALID_BIT) && (pte & WRITE_BIT) && frameDirty(pfn)) ? frame : NULL;
+}
+
+// Rebuild the whole page map from the page table at reg[PTBR]
+void rebuildPageMap() {
+  for (uint16_t vpn = 0; vpn < PAGE_TABLE_SIZE_IN_WORDS; vpn++) {
+    rmap[vpn] = NULL;
+    wmap[vpn] = NULL;
+    updatePageMap(reg[PTBR], vpn);
+  }
+}
+
+// Drop one reference to a page frame, freeing it once nothing maps it anymore. Needs frameLock.
+void releaseFrame(uint16_t pfn) {
+  if (--frameRefs[pfn] > 0) return;
+
+  uint32_t bitmap = GET_BITMAP();          // Get the bitmap from memory
+  int freePFNidx = 31 - pfn;
+  bitmap |= (1 << freePFNidx);             // Mark the page frame as free (1) in the bitmap          
+  setBitmap(bitmap);                       // Update the bitmap in memory
+
+  // A shared region lives only as long as its frame
+  for (int i = 0; i < MAX_SHM_REGIONS; i++) {
+    if (shmRegions[i].used && shmRegions[i].pfn == pfn) shmRegions[i].used = false;
+  }
+
+  // The frame still holds its last owner's data, let the zeroer clear it
+  pthread_cond_signal(&zeroerWake);
+}
+
+// Zero free dirty frames in the background until stopped and the pool is full
+void *zeroFrames(void *arg) {
+  pthread_mutex_lock(&frameLock);
+  while (true) {
+    uint32_t dirty = GET_BITMAP() & ~zeroedFrames;
+    if (dirty == 0) {
+      if (zeroerStop) break;
+      pthread_cond_wait(&zeroerWake, &frameLock);
+      continue;
+    }
+
+    // 1. Claim the lowest dirty frame
+    int i = 31;
+    while (!(dirty & ((uint32_t)1 << i))) i--;
+    zeroingFrames |= (uint32_t)1 << i;
+
+    // 2. Clear it without holding frameLock, the claim keeps allocMem() away from it
+    pthread_mutex_unlock(&frameLock);
+    memset(mem + (31 - i) * PAGE_SIZE_IN_WORDS, 0, PAGE_SIZE_IN_WORDS * sizeof(uint16_t));
+    markDirty(31 - i);
+    pthread_mutex_lock(&frameLock);
+
+    // 3. Publish it to the pool
+    zeroingFrames &= ~((uint32_t)1 << i);
+    zeroedFrames |= (uint32_t)1 << i;
+    pthread_cond_broadcast(&frameZeroed);
+  }
+  pthread_mutex_unlock(&frameLock);
+  return NULL;
+}
+
+void startZeroer() {
+  zeroerStop = false;
+  pthread_create(&zeroer, NULL, zeroFrames, NULL);
+}
+
+// Wait for the pool to be refilled and stop the zeroer
+void stopZeroer() {
+  pthread_mutex_lock(&frameLock);
+  zeroerStop = true;
+  pthread_cond_signal(&zeroerWake);
+  pthread_mutex_unlock(&frameLock);
+  pthread_join(zeroer, NULL);
+}
+
+// Map an already allocated page frame at vpn, taking a reference to it. Needs frameLock.
+void mapFrame(uint16_t ptbr, uint16_t vpn, uint16_t pfn, uint16_t perm) {
+  frameRefs[pfn]++;
+  mem[ptbr + vpn] = (pfn << PFN_SHIFT) | (perm & (READ_BIT | WRITE_BIT)) | VALID_BIT;
+  updatePageMap(ptbr, vpn);
+}
+
+/*
+  Slow path of mr/mw: the page map has no entry, so find out from the PTE why.
+  Return the frame if this is just the first write to a clean frame, NULL on a fault.
+*/
+uint16_t *accessFault(uint16_t address, bool write) {
+  uint16_t vpn = address >> VPN_SHIFT;
+
+  // 1. If address belongs to reserved region
+  if (vpn < NOT_RESERVED_START_VPN) {
+    handleSegFault("Segmentation fault.", FAULT_RESERVED, address);
+    return NULL;
+  }
+
+  // 2. A writable page whose frame is still clean: mark it dirty and map it for writing
+  uint16_t pte = mem[reg[PTBR] + vpn];
+  if (write && (pte & VALID_BIT) && (pte & WRITE_BIT)) {
+    uint16_t pfn = (pte >> PFN_SHIFT) & PFN_MASK;
+    markDirty(pfn);
+    wmap[vpn] = mem + pfn * PAGE_SIZE_IN_WORDS;
+    return wmap[vpn];
+  }
+
+  // 3. Otherwise either the page is not valid or the access is not permitted
+  if (!(pte & VALID_BIT)) {
+    handleSegFault("Segmentation fault inside free space.", FAULT_FREE_SPACE, address);
+  }
+  else if (write) {
+    handleSegFault("Cannot write to a read-only page.", FAULT_WRITE, address);
+  }
+  else {
+    handleSegFault("Cannot read from a write-only page.", FAULT_READ, address);
+  }
+  return NULL;
 }
 
 /* Initialize OS-related parts of physical mem */
@@ -217,6 +556,15 @@ void initOS() {
   // Set OSStatus to 0x0000
   mem[OS_STATUS] = 0x0000;
 
+  // Set up the locks shared by the CPUs and their run queues
+  pthread_mutex_init(&frameLock, NULL);
+  pthread_mutex_init(&procLock, NULL);
+  for (int i = 0; i < MAX_CPUS; i++) {
+    pthread_mutex_init(&runQueues[i].lock, NULL);
+    runQueues[i].head = 0;
+    runQueues[i].count = 0;
+  }
+
   // Initialize bitmap for free pages. 
   // Bitmap is 32 bits long. Each bit represents a page.
   // mem[3] and mem[4] are used to store the bitmap
@@ -227,11 +575,16 @@ void initOS() {
   // mem[4] = 1111 1111 1111 1111
   mem[BITMAP_HIGH] = 0x1FFF;
   mem[BITMAP_LOW] = UINT16_MAX;
+  // Physical memory starts out zeroed, so every free frame is in the pool
+  zeroedFrames = GET_BITMAP();
 
   // Initialize the padding between bitmap and PCB list
   for (uint16_t i = BITMAP_LOW + 1; i < PCB_LIST_BASE; i++) {
     mem[i] = 0;
   } 
+  // No process is alive and no PCB slot has been freed yet
+  mem[Live_Proc_Count] = 0;
+  mem[Free_PCB_Head] = INVALID_PID;
 
   // PCB list and page table will be initialized in createProc
   return;
@@ -239,8 +592,121 @@ void initOS() {
 
 // Process functions to implement
 
+// Append pid to the run queue of cpu
+void enqueueProc(int cpu, uint16_t pid) {
+  struct run_queue *q = &runQueues[cpu];
+  pthread_mutex_lock(&q->lock);
+  q->pids[(q->head + q->count) % MAX_PAGE_TABLES] = pid;
+  q->count++;
+  pthread_mutex_unlock(&q->lock);
+
+  // Wake an idle CPU to run it
+  __atomic_fetch_add(&readyProcs, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&idleCpus, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&idleLock);
+    pthread_cond_signal(&workReady);
+    pthread_mutex_unlock(&idleLock);
+  }
+}
+
+// Take the oldest pid from the run queue of cpu, INVALID_PID if it is empty
+uint16_t dequeueProc(int cpu) {
+  struct run_queue *q = &runQueues[cpu];
+  uint16_t pid = INVALID_PID;
+  pthread_mutex_lock(&q->lock);
+  if (q->count > 0) {
+    pid = q->pids[q->head];
+    q->head = (q->head + 1) % MAX_PAGE_TABLES;
+    q->count--;
+    __atomic_fetch_sub(&readyProcs, 1, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return pid;
+}
+
+// Next process for this CPU: its own queue first, then steal from the others
+uint16_t pickNext() {
+  for (int i = 0; i < cpuCount; i++) {
+    uint16_t pid = dequeueProc((cpuId + i) % cpuCount);
+    if (pid != INVALID_PID) return pid;
+  }
+  return INVALID_PID;
+}
+
+// PCB slot the next createProc() will use, INVALID_PID if the PCB list is full
+uint16_t nextFreePid() {
+  if (mem[Free_PCB_Head] != INVALID_PID) return mem[Free_PCB_Head];
+  if (mem[Proc_Count] < MAX_PAGE_TABLES) return mem[Proc_Count];
+  return INVALID_PID;
+}
+
+// Take a PCB slot, reusing a freed one if there is any
+uint16_t allocPCB() {
+  uint16_t pid = mem[Free_PCB_Head];
+  if (pid != INVALID_PID) {
+    mem[Free_PCB_Head] = mem[PCB_LIST_BASE + pid * PCB_SIZE + PC_PCB];
+  }
+  else {
+    pid = mem[Proc_Count];
+    mem[Proc_Count]++; // Increment Proc_Count
+  }
+
+  if (nextFreePid() == INVALID_PID) {
+    mem[OS_STATUS] |= 0x0001;   // OS memory is full, mark as 1
+  }
+  return pid;
+}
+
+// Give a PCB slot back. The slot stays terminated until createProc() reuses it.
+void freePCB(uint16_t pid) {
+  uint16_t pcbIndex = PCB_LIST_BASE + pid * PCB_SIZE;
+  mem[pcbIndex + PID_PCB] = INVALID_PID;
+  mem[pcbIndex + PC_PCB] = mem[Free_PCB_Head];
+  mem[Free_PCB_Head] = pid;
+  mem[OS_STATUS] &= ~0x0001;
+}
+
+// Frames reserved for a process whose code and heap images still have to be read
+struct proc_image {
+  uint16_t pid;
+  char *fname;
+  char *hname;
+  uint16_t codeOffsets[CODE_SIZE];
+  uint16_t heapOffsets[HEAP_INIT_SIZE];
+};
+
+int reserveProc(char *fname, char *hname, struct proc_image *img);
+void loadProcImage(struct proc_image *img);
+void queueProc(uint16_t pid);
+
 /* Create process. Return 0 on fail, 1 on success. */
 int createProc(char *fname, char *hname) {
+  return startProc(fname, hname) != INVALID_PID;
+}
+
+// Create a process, reading its images without holding procLock. Return its pid, INVALID_PID on fail.
+uint16_t startProc(char *fname, char *hname) {
+  struct proc_image img;
+  pthread_mutex_lock(&procLock);
+  int ok = reserveProc(fname, hname, &img);
+  pthread_mutex_unlock(&procLock);
+  if (!ok) return INVALID_PID;
+
+  // Nobody runs the process before it is queued, so its frames are ours until then
+  loadProcImage(&img);
+
+  pthread_mutex_lock(&procLock);
+  queueProc(img.pid);
+  pthread_mutex_unlock(&procLock);
+  return img.pid;
+}
+
+/*
+  Serial part of createProc: set up the PCB and page table and allocate the code and
+  heap frames, leaving the images to loadProcImage() and the run queue to queueProc().
+  Needs procLock. Return 0 on fail.
+*/
+int reserveProc(char *fname, char *hname, struct proc_image *img) {
   // 1. Check if OS region of mem is full. Then cannot allocate new PCB
   if (mem[OS_STATUS] & 0x0001) {
     printf("The OS memory region is full. Cannot create a new PCB.\n");
@@ -248,20 +714,22 @@ int createProc(char *fname, char *hname) {
   }
 
   // 2. Check if enough free pages for allocating code segment
+  pthread_mutex_lock(&frameLock);
   if (!checkFreePages(CODE_SIZE)) {
+    pthread_mutex_unlock(&frameLock);
     printf("Cannot create code segment.\n");
     return 0;
   }
     
   // 3. Check if enough free pages for allocating heap segment 
   if (!checkFreePages(HEAP_INIT_SIZE)) {
+    pthread_mutex_unlock(&frameLock);
     printf("Cannot create heap segment.\n");
     return 0;
   }
 
   // Process variables
-  uint16_t pid = mem[Proc_Count];
-  mem[Proc_Count]++; // Increment Proc_Count
+  uint16_t pid = allocPCB();
   uint16_t pcbIndex = PCB_LIST_BASE + pid * PCB_SIZE;
 
   // 4. Fill in PCB for the process
@@ -270,65 +738,170 @@ int createProc(char *fname, char *hname) {
   uint16_t pageTableBase = allocatePageTable(pid);
   mem[pcbIndex + PTBR_PCB] = pageTableBase;
 
+  // 5. Clear the page table, a recycled slot still has the PTEs of its previous owner
+  memset(mem + pageTableBase, 0, PAGE_TABLE_SIZE_IN_WORDS * sizeof(uint16_t));
+
   // 6. Allocate memory (2 pages) for code via allocMem
-  uint16_t codeOffsets[2];
-  codeOffsets[0] = allocMem(pageTableBase, CODE_VPN_START, UINT16_MAX, 0);
-  codeOffsets[1] = allocMem(pageTableBase, CODE_VPN_START + 1, UINT16_MAX, 0);
+  uint16_t *codeOffsets = img->codeOffsets;
+  codeOffsets[0] = allocMemLocked(pageTableBase, CODE_VPN_START, UINT16_MAX, 0);
+  codeOffsets[1] = allocMemLocked(pageTableBase, CODE_VPN_START + 1, UINT16_MAX, 0);
   if (codeOffsets[0] == 0 || codeOffsets[1] == 0) {
-    printf("Cannot allocate memory for code segment.\n");
     freeAllocatedResources(pageTableBase, CODE_VPN_START, CODE_VPN_START + 1);
+    pthread_mutex_unlock(&frameLock);
+    printf("Cannot allocate memory for code segment.\n");
+    freePCB(pid);
     return 0;
   }
-  // Initialize code segment by reading fname using ld_img
-  ld_img(fname, codeOffsets, CODE_SIZE * PAGE_SIZE_IN_WORDS);
 
   // 7. Allocate memory (2 pages) for heap via allocMem
-  uint16_t heapOffsets[2];
-  heapOffsets[0] = allocMem(pageTableBase, HEAP_VPN_START, UINT16_MAX, UINT16_MAX);
-  heapOffsets[1] = allocMem(pageTableBase, HEAP_VPN_START + 1, UINT16_MAX, UINT16_MAX);
+  uint16_t *heapOffsets = img->heapOffsets;
+  heapOffsets[0] = allocMemLocked(pageTableBase, HEAP_VPN_START, UINT16_MAX, UINT16_MAX);
+  heapOffsets[1] = allocMemLocked(pageTableBase, HEAP_VPN_START + 1, UINT16_MAX, UINT16_MAX);
   if (heapOffsets[0] == 0 || heapOffsets[1] == 0) {
-    printf("Cannot allocate memory for heap segment.\n");
     freeAllocatedResources(pageTableBase, CODE_VPN_START, CODE_VPN_START + 1);
     freeAllocatedResources(pageTableBase, HEAP_VPN_START, HEAP_VPN_START + 1);
+    pthread_mutex_unlock(&frameLock);
+    printf("Cannot allocate memory for heap segment.\n");
+    freePCB(pid);
     return 0;
   }
-  // Initialize heap segment by reading hname using ld_img
-  ld_img(hname, heapOffsets, HEAP_INIT_SIZE * PAGE_SIZE_IN_WORDS);
+  pthread_mutex_unlock(&frameLock);
+  img->pid = pid;
+  img->fname = fname;
+  img->hname = hname;
 
-  if (mem[Proc_Count] == MAX_PROCESS_NUM) {
-    mem[OS_STATUS] |= 0x0001;   // OS memory is full, mark as 1
-  }
+  __atomic_fetch_add(&mem[Live_Proc_Count], 1, __ATOMIC_SEQ_CST);  // Read by idle CPUs without procLock
   return 1;
 }
 
+// Make a loaded process runnable, spreading new processes over the CPUs. Needs procLock.
+void queueProc(uint16_t pid) {
+  enqueueProc(nextQueue, pid);
+  nextQueue = (nextQueue + 1) % cpuCount;
+}
+
+// Initialize the code and heap segments by reading the image files into the reserved frames
+void loadProcImage(struct proc_image *img) {
+  ld_img(img->fname, img->codeOffsets, CODE_SIZE * PAGE_SIZE_IN_WORDS);
+  ld_img(img->hname, img->heapOffsets, HEAP_INIT_SIZE * PAGE_SIZE_IN_WORDS);
+}
+
+// Images of the processes created at startup, shared by the loader threads
+struct load_jobs {
+  struct proc_image *imgs;
+  int count;
+  int next;   // Next image to load, taken atomically
+};
+
+void *loadImages(void *arg) {
+  struct load_jobs *jobs = arg;
+  int i;
+  while ((i = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < jobs->count) {
+    loadProcImage(&jobs->imgs[i]);
+  }
+  return NULL;
+}
+
+/*
+  Create the processes for count code/heap name pairs. PCBs, page tables and frames are
+  reserved one process after the other, then the images, which land in distinct frames,
+  are read by up to loaders threads in parallel. The processes are queued once all
+  images are in. Return the number of processes created.
+*/
+int createProcs(char **names, int count, int loaders) {
+  struct proc_image *imgs = malloc(count * sizeof(struct proc_image));
+  struct load_jobs jobs = {imgs, 0, 0};
+
+  // 1. Serial phase
+  pthread_mutex_lock(&procLock);
+  for (int i = 0; i < count; i++) {
+    if (reserveProc(names[2 * i], names[2 * i + 1], &imgs[jobs.count])) jobs.count++;
+  }
+  pthread_mutex_unlock(&procLock);
+
+  // 2. Parallel phase, the calling thread is one of the loaders
+  if (loaders > jobs.count) loaders = jobs.count;
+  pthread_t *threads = malloc((loaders > 1 ? loaders : 1) * sizeof(pthread_t));
+  for (int i = 1; i < loaders; i++) {
+    pthread_create(&threads[i], NULL, loadImages, &jobs);
+  }
+  loadImages(&jobs);
+  for (int i = 1; i < loaders; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // 3. Make them runnable in creation order
+  pthread_mutex_lock(&procLock);
+  for (int i = 0; i < jobs.count; i++) {
+    queueProc(imgs[i].pid);
+  }
+  pthread_mutex_unlock(&procLock);
+
+  free(threads);
+  free(imgs);
+  return jobs.count;
+}
+
 void loadProc(uint16_t pid) {
   // Calculate the PCB index based on pid
   uint16_t pcbIndex = PCB_LIST_BASE + pid * PCB_SIZE;
   // Retrieve PC, PTBR values
+  pthread_mutex_lock(&procLock);
   uint16_t pc = mem[pcbIndex + PC_PCB];
   uint16_t ptbr = mem[pcbIndex + PTBR_PCB];
+  mem[Cur_Proc_ID] = pid;
+  pthread_mutex_unlock(&procLock);
 
   // Restore them into CPU registers
   reg[RPC] = pc;
   reg[PTBR] = ptbr;
+  rebuildPageMap();
   // Set the current process ID
-  mem[Cur_Proc_ID] = pid;
+  curPid = pid;
+  trace_event(TRACE_RUN_BEGIN, cpuId, pid, 0, 0);
+}
+
+// Load the next process from the run queues into this CPU, or stop it if there is none
+void dispatch() {
+  uint16_t pid = pickNext();
+  if (pid == INVALID_PID) {
+    running = false;
+    return;
+  }
+  loadProc(pid);
+  running = true;
+}
+
+// Bitmap index of the lowest free page frame, -1 if there is none. Needs frameLock.
+int firstFreeFrame() {
+  uint32_t bitmap = GET_BITMAP();
+  for (int i = 31; i >= 0; i--) {
+    if (bitmap & ((uint32_t)1 << i)) return i;
+  }
+  return -1;
 }
 
 /* Return 0 on fail, otherwise return physical address of the page frame allocated */
 uint16_t allocMem(uint16_t ptbr, uint16_t vpn, uint16_t read, uint16_t write) {
-  int freePFNidx = -1;
+  pthread_mutex_lock(&frameLock);
+  uint16_t offset = allocMemLocked(ptbr, vpn, read, write);
+  pthread_mutex_unlock(&frameLock);
+  return offset;
+}
+
+uint16_t allocMemLocked(uint16_t ptbr, uint16_t vpn, uint16_t read, uint16_t write) {
   // 1. Find the first free page frame by searching the bitmap
-  uint32_t bitmap = GET_BITMAP();
-  for (int i = 31; i >= 0; i--) {
-    if (bitmap & (1 << i)){
-      freePFNidx = i;
-      break;
-    }
+  int freePFNidx = firstFreeFrame();
+
+  // The zeroer is clearing this frame right now, wait for it and look again
+  while (freePFNidx != -1 && (zeroingFrames & ((uint32_t)1 << freePFNidx))) {
+    pthread_cond_wait(&frameZeroed, &frameLock);
+    freePFNidx = firstFreeFrame();
   }
 
   // If no free pages left, return 0
   if (freePFNidx == -1) return 0; 
+  uint32_t bitmap = GET_BITMAP();
 
   // 2. Calculate physical address of PTE for this VPN
   uint16_t pte = mem[ptbr + vpn];
@@ -346,6 +919,13 @@ uint16_t allocMem(uint16_t ptbr, uint16_t vpn, uint16_t read, uint16_t write) {
 
   // 5. Construct the PTE
   int PFN = 31- freePFNidx; // Calculate the PFN based on the freePFN index
+
+  // Never hand out another process' data. memset is vectorized by the C library.
+  if (!(zeroedFrames & ((uint32_t)1 << freePFNidx))) {
+    memset(mem + PFN * PAGE_SIZE_IN_WORDS, 0, PAGE_SIZE_IN_WORDS * sizeof(uint16_t));
+  }
+  zeroedFrames &= ~((uint32_t)1 << freePFNidx);
+
   pte = PFN << PFN_SHIFT;
   if (read == UINT16_MAX) pte |= READ_BIT;
   if (write == UINT16_MAX) pte |= WRITE_BIT;
@@ -353,12 +933,23 @@ uint16_t allocMem(uint16_t ptbr, uint16_t vpn, uint16_t read, uint16_t write) {
 
   // 6. Write the PTE into the page table 
   mem[ptbr + vpn] = pte;
+  markDirty(PFN);
+  updatePageMap(ptbr, vpn);
+  frameRefs[PFN] = 1;
+  trace_event(TRACE_ALLOC, cpuId, (ptbr - PAGE_TABLE_BASE) / PAGE_TABLE_SIZE_IN_WORDS, vpn, PFN);
 
   uint16_t offset = PFN * PAGE_SIZE_IN_WORDS;
   return offset; // Return offset of the page frame into memory
 }
 
 int freeMem(uint16_t vpn, uint16_t ptbr) {
+  pthread_mutex_lock(&frameLock);
+  int ret = freeMemLocked(vpn, ptbr);
+  pthread_mutex_unlock(&frameLock);
+  return ret;
+}
+
+int freeMemLocked(uint16_t vpn, uint16_t ptbr) {
   // 1. Calculate the physical address of the PTE for this VPN
   uint16_t pte = mem[ptbr + vpn];
 
@@ -369,17 +960,12 @@ int freeMem(uint16_t vpn, uint16_t ptbr) {
   // Clear valid bit
   pte &= ~VALID_BIT;
   mem[ptbr + vpn] = pte;
+  updatePageMap(ptbr, vpn);
   
-  // Update the bitmap
+  // Update the bitmap, unless the frame is still mapped by another process
   int PFN = (pte >> PFN_SHIFT) & PFN_MASK; // Get the PFN from the PTE
-
-  uint32_t bitmap = GET_BITMAP();          // Get the bitmap from memory
-  int freePFNidx = 31 - PFN;
-  bitmap |= (1 << freePFNidx);             // Mark the page frame as free (1) in the bitmap          
-
-  setBitmap(bitmap);                       // Update the bitmap in memory
-  // If bitmap is not full, set OS_STATUS bit to 0
-  if (bitmap != 0) mem[OS_STATUS] &= ~0x0001;
+  trace_event(TRACE_FREE, cpuId, (ptbr - PAGE_TABLE_BASE) / PAGE_TABLE_SIZE_IN_WORDS, vpn, PFN);
+  releaseFrame(PFN);
   
   return 0;
 }
@@ -392,11 +978,12 @@ static inline void tbrk() {
   uint16_t read_access = request & READ_BIT;
   uint16_t allocOrFree = request & 0x0001;
 
-  uint16_t cur_pid = mem[Cur_Proc_ID];
+  uint16_t cur_pid = curPid;
   uint16_t ptbr = reg[PTBR];
   uint16_t pte = mem[ptbr + vpn];
 
   uint16_t valid_bit = pte & VALID_BIT;
+  trace_event(TRACE_BRK, cpuId, cur_pid, request, 0);
 
   if (allocOrFree) {  // Allocation request
     printf("Heap increase requested by process %hu.\n", cur_pid);
@@ -406,7 +993,9 @@ static inline void tbrk() {
       return;
     }
 
+    pthread_mutex_lock(&frameLock);
     if (!checkFreePages(1)) { // 2. No free page frames left
+      pthread_mutex_unlock(&frameLock);
       printf("Cannot allocate more space for pid %hu since there is no free page frames.\n", cur_pid);
       return;
     }
@@ -414,7 +1003,8 @@ static inline void tbrk() {
     // 3. Allocate new page frame for the VPN
     uint16_t read_arg = read_access ? UINT16_MAX : 0;
     uint16_t write_arg = write_access ? UINT16_MAX : 0;
-    allocMem(ptbr, vpn, read_arg, write_arg);
+    allocMemLocked(ptbr, vpn, read_arg, write_arg);
+    pthread_mutex_unlock(&frameLock);
   } 
   else {
     printf("Heap decrease requested by process %hu.\n", cur_pid);
@@ -429,139 +1019,344 @@ static inline void tbrk() {
   }
 }
 
+// The current process leaves this CPU, by yielding or exiting
+void unloadProc(uint16_t pid) {
+  cnd(); // Flags must be up to date before the register file changes hands
+  trace_event(TRACE_RUN_END, cpuId, pid, 0, 0);
+}
+
 static inline void tyld() {
-  uint16_t cur_pid = mem[Cur_Proc_ID];
+  uint16_t cur_pid = curPid;
   uint16_t pcbIndex = PCB_LIST_BASE + cur_pid * PCB_SIZE;
 
   // 1. Find the next runnable process
-  uint16_t totalProc = mem[Proc_Count];
-  uint16_t next_pid = (cur_pid + 1) % totalProc;
-
-  while (next_pid != cur_pid) {
-    // Check if process has not terminated by checking validity of PID_PCB
-    uint16_t nextPCBIndex = PCB_LIST_BASE + next_pid * PCB_SIZE;
-    if (mem[nextPCBIndex + PID_PCB] != INVALID_PID) { // Runnable process is found
-      printf("We are switching from process %d to %d.\n", cur_pid, next_pid);
+  uint16_t next_pid = pickNext();
 
-      // 2. Save PC to current process' PC_PCB ONLY WHEN SWITCHING TO ANOTHER PROCESS
-      mem[pcbIndex + PC_PCB] = reg[RPC];
-
-      loadProc(next_pid); // Load the process to registers
-      return;
-    }
-    next_pid = (next_pid + 1) % totalProc; // Move to next pid
+  // 2. No other runnable processes found, DO NOT LOAD IT AGAIN, just continue running the current process
+  if (next_pid == INVALID_PID) {
+    //printf("No runnable processes found. Continuing with process %d.\n", cur_pid);
+    return;
   }
+  printf("We are switching from process %d to %d.\n", cur_pid, next_pid);
+
+  // 3. Save PC to current process' PC_PCB ONLY WHEN SWITCHING TO ANOTHER PROCESS, then queue it again
+  pthread_mutex_lock(&procLock);
+  mem[pcbIndex + PC_PCB] = reg[RPC];
+  pthread_mutex_unlock(&procLock);
+  unloadProc(cur_pid);
+  enqueueProc(cpuId, cur_pid);
 
-  // 3. No other runnable processes found, DO NOT LOAD IT AGAIN, just continue running the current process
-  //printf("No runnable processes found. Continuing with process %d.\n", cur_pid);
+  loadProc(next_pid); // Load the process to registers
 }
 
-// Instructions to modify
-static inline void thalt() {
-  uint16_t cur_pid = mem[Cur_Proc_ID];
-  uint16_t pcbIndex = PCB_LIST_BASE + cur_pid * PCB_SIZE;
+// Free every page of the current process and recycle its PCB slot
+void exitProc(uint16_t status) {
+  uint16_t cur_pid = curPid;
+  unloadProc(cur_pid);
+  pthread_mutex_lock(&procLock);
 
   // 1. Get the PTBR for the current process
   uint16_t ptbr = reg[PTBR];
 
   // 2. Iterate over all PTEs and free valid pages
+  pthread_mutex_lock(&frameLock);
   for (uint16_t vpn = 0; vpn < PAGE_TABLE_SIZE_IN_WORDS; vpn++) {
-    freeMem(vpn, ptbr); // freeMem already checks if the page is valid
+    freeMemLocked(vpn, ptbr); // freeMem already checks if the page is valid
   }
 
-  // 3. Mark the process as terminated by setting PID_PCB to 0xffff
-  mem[pcbIndex + PID_PCB] = INVALID_PID;
+  // 3. Drop the pages that were sent to this process but never received
+  struct mailbox *box = &mailboxes[cur_pid];
+  for (; box->count > 0; box->count--) {
+    releaseFrame(box->msgs[box->head].pfn);
+    box->head = (box->head + 1) % MAILBOX_SIZE;
+  }
+  pthread_mutex_unlock(&frameLock);
+
+  // 4. Mark the process as terminated by setting PID_PCB to 0xffff and put the slot on the free list
+  freePCB(cur_pid);
+  uint16_t live = __atomic_sub_fetch(&mem[Live_Proc_Count], 1, __ATOMIC_SEQ_CST);
+
+  // 5. Log how it ended
+  if (exitCount < EXIT_LOG_SIZE) {
+    struct exit_record *rec = &exitRecords[exitCount];
+    *rec = (status == EXIT_FAULTED) ? faultRecord : (struct exit_record){0};
+    rec->pid = cur_pid;
+    rec->status = status;
+  }
+  exitCount++;
+  pthread_mutex_unlock(&procLock);
+
+  // The last process is gone, let every idle CPU stop
+  if (live == 0) {
+    pthread_mutex_lock(&idleLock);
+    pthread_cond_broadcast(&workReady);
+    pthread_mutex_unlock(&idleLock);
+  }
+}
 
-  // 4. Check if all processes are halted, if yes stop the VM. Otherwise switch to the next runnable process
-  uint16_t totalProc = mem[Proc_Count];
-  uint16_t allHalted = 1;
+// Sleep until a process is queued or none is left alive
+void waitForWork() {
+  pthread_mutex_lock(&idleLock);
+  __atomic_fetch_add(&idleCpus, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&readyProcs, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&mem[Live_Proc_Count], __ATOMIC_SEQ_CST) > 0) {
+    pthread_cond_wait(&workReady, &idleLock);
+  }
+  __atomic_fetch_sub(&idleCpus, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&idleLock);
+}
+
+/*
+  Called whenever the run loop of this CPU stops. Reap the process that faulted, if any,
+  then wait for a runnable process. Return false once every process has terminated.
+*/
+bool cpuIdle() {
+  if (faultPending) reapFault();
 
-  for (uint16_t pid = 0; pid < totalProc; pid++) {
-    uint16_t pcbIndex = PCB_LIST_BASE + pid * PCB_SIZE;
-    if (mem[pcbIndex + PID_PCB] != INVALID_PID) {
-      allHalted = 0;  // Found a process that is not invalid
-      break;
+  while (!running) {
+    if (__atomic_load_n(&mem[Live_Proc_Count], __ATOMIC_SEQ_CST) == 0) {
+      //printf("All processes halted. Halting VM.\n");
+      return false;
     }
+
+    // The other live processes are either queued somewhere or running on another CPU
+    dispatch();
+    if (!running) waitForWork();
   }
+  return true;
+}
 
-  if (allHalted) { 
-    //printf("All processes halted. Halting VM.\n");
-    running = false; // Stop the VM 
-  } 
-  else { // Find the next runnable process and load it
-    //printf("Switching to the next runnable process.\n");
-    uint16_t next_pid = (cur_pid + 1) % totalProc;
-    
-    while (next_pid != cur_pid) {
-      // Check if process has not terminated by checking validity of PID_PCB
-      uint16_t nextPCBIndex = PCB_LIST_BASE + next_pid * PCB_SIZE;
-      if (mem[nextPCBIndex + PID_PCB] != INVALID_PID) {
-        // Runnable process is found
-        loadProc(next_pid); // Load the process to registers
-        return;
-      }
-      next_pid = (next_pid + 1) % totalProc; // Move to next pid
-    }
-  } 
+// Copy a NUL terminated string, one character per word, from the current process' memory
+bool readGuestString(uint16_t address, char *buf, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    buf[i] = (char)mr(address + i);
+    if (faultPending) return false;
+    if (buf[i] == '\0') return true;
+  }
+  return false;
 }
 
-static inline uint16_t mr(uint16_t address) {
-  uint16_t vpn = address >> VPN_SHIFT;
-  uint16_t offset = address & 0x07FF;
+/*
+  Create a process at runtime. R0 and R1 hold the addresses of the code and heap
+  file names. The new pid is returned in R0, or 0xFFFF if it could not be created.
+*/
+static inline void tspawn() {
+  char fname[MAX_FILE_NAME];
+  char hname[MAX_FILE_NAME];
+  uint16_t cur_pid = curPid;
+  uint16_t fnameAddr = reg[R0];
+  reg[R0] = INVALID_PID;
+
+  if (!readGuestString(fnameAddr, fname, MAX_FILE_NAME)) return;
+  if (!readGuestString(reg[R1], hname, MAX_FILE_NAME)) return;
+  printf("Process %hu requested to spawn %s %s.\n", cur_pid, fname, hname);
+
+  // ld_img exits the VM on a missing file, so check both files before reserving anything
+  FILE *f = fopen(fname, "rb");
+  FILE *h = fopen(hname, "rb");
+  if (f) fclose(f);
+  if (h) fclose(h);
+  if (!f || !h) {
+    printf("Cannot spawn a process for pid %hu since its image files cannot be opened.\n", cur_pid);
+    return;
+  }
 
-  // 1. If address belongs to reserved region 
-  if (vpn < NOT_RESERVED_START_VPN) {
-    handleSegFault("Segmentation fault.");
-     ;
+  reg[R0] = startProc(fname, hname);
+}
+
+/*
+  Map the shared region named R0 at the page given in R1, encoded like a brk request
+  (VPN in the top 5 bits, WRITE_BIT and READ_BIT for this process' permissions).
+  The region is created on first use. R0 returns the address of the page, 0xFFFF on failure.
+*/
+static inline void tshm() {
+  uint16_t key = reg[R0];
+  uint16_t request = reg[R1];
+  uint16_t vpn = (request >> VPN_SHIFT) & PFN_MASK;
+  uint16_t perm = request & (READ_BIT | WRITE_BIT);
+  uint16_t cur_pid = curPid;
+  uint16_t ptbr = reg[PTBR];
+  reg[R0] = UINT16_MAX;
+
+  if (vpn < NOT_RESERVED_START_VPN || (mem[ptbr + vpn] & VALID_BIT)) {
+    printf("Cannot map shared region %hu at page %hu of pid %hu.\n", key, vpn, cur_pid);
+    return;
   }
 
-  // 2. Get PTE using VPN and PTBR. Then check valid bit
-  uint16_t pte = mem[reg[PTBR] + vpn];
-  if (!(pte & VALID_BIT)) {
-    handleSegFault("Segmentation fault inside free space.");
-    return SEG_FAULT_OUTPUT;
+  pthread_mutex_lock(&frameLock);
+  tshmLocked(key, vpn, perm);
+  pthread_mutex_unlock(&frameLock);
+}
+
+void tshmLocked(uint16_t key, uint16_t vpn, uint16_t perm) {
+  uint16_t cur_pid = curPid;
+  uint16_t ptbr = reg[PTBR];
+
+  // 1. Attach to the region if it already exists
+  int freeSlot = -1;
+  for (int i = 0; i < MAX_SHM_REGIONS; i++) {
+    if (shmRegions[i].used && shmRegions[i].key == key) {
+      mapFrame(ptbr, vpn, shmRegions[i].pfn, perm);
+      reg[R0] = vpn << VPN_SHIFT;
+      return;
+    }
+    if (!shmRegions[i].used && freeSlot == -1) freeSlot = i;
   }
 
-  // 3. Check if read allowed
-  if (!(pte & READ_BIT)) {
-    handleSegFault("Cannot read from a write-only page.");
-    return SEG_FAULT_OUTPUT;
+  // 2. Otherwise create it with a fresh page frame
+  if (freeSlot == -1 || !checkFreePages(1)) {
+    printf("Cannot create shared region %hu for pid %hu.\n", key, cur_pid);
+    return;
   }
+  allocMemLocked(ptbr, vpn, (perm & READ_BIT) ? UINT16_MAX : 0, (perm & WRITE_BIT) ? UINT16_MAX : 0);
+  shmRegions[freeSlot].used = true;
+  shmRegions[freeSlot].key = key;
+  shmRegions[freeSlot].pfn = (mem[ptbr + vpn] >> PFN_SHIFT) & PFN_MASK;
+  reg[R0] = vpn << VPN_SHIFT;
+}
 
-  // 4. Finally read the value from memory
-  // Compute the physical address using PFN and offset
-  uint16_t pfn = (pte >> PFN_SHIFT) & PFN_MASK;
-  uint16_t physicalAddress = pfn * PAGE_SIZE_IN_WORDS + offset;
+/*
+  Send the page holding address R1 to process R0. The page is unmapped from the sender
+  and handed to the receiver's mailbox without copying. R0 returns 1 on success, 0 on failure.
+*/
+static inline void tsend() {
+  pthread_mutex_lock(&procLock);
+  tsendLocked();
+  pthread_mutex_unlock(&procLock);
+}
+
+void tsendLocked() {
+  uint16_t dest = reg[R0];
+  uint16_t vpn = reg[R1] >> VPN_SHIFT;
+  uint16_t cur_pid = curPid;
+  uint16_t ptbr = reg[PTBR];
+  uint16_t pte = mem[ptbr + vpn];
+  reg[R0] = 0;
 
-  return mem[physicalAddress];
+  if (dest >= mem[Proc_Count] || dest == cur_pid || mem[PCB_LIST_BASE + dest * PCB_SIZE + PID_PCB] == INVALID_PID) {
+    printf("Cannot send a page from pid %hu to pid %hu since it is not running.\n", cur_pid, dest);
+    return;
+  }
+  if (vpn < NOT_RESERVED_START_VPN || !(pte & VALID_BIT)) {
+    printf("Cannot send page %hu of pid %hu since it is not allocated.\n", vpn, cur_pid);
+    return;
+  }
+  struct mailbox *box = &mailboxes[dest];
+  if (box->count == MAILBOX_SIZE) {
+    printf("Cannot send a page to pid %hu since its mailbox is full.\n", dest);
+    return;
+  }
+
+  // Move the reference from the sender's PTE to the message
+  struct message *msg = &box->msgs[(box->head + box->count) % MAILBOX_SIZE];
+  msg->sender = cur_pid;
+  msg->pfn = (pte >> PFN_SHIFT) & PFN_MASK;
+  msg->perm = pte & (READ_BIT | WRITE_BIT);
+  box->count++;
+
+  mem[ptbr + vpn] = pte & ~VALID_BIT;
+  updatePageMap(ptbr, vpn);
+  reg[R0] = 1;
 }
 
-static inline void mw(uint16_t address, uint16_t val) {
-  uint16_t vpn = address >> VPN_SHIFT;
-  uint16_t offset = address & 0x07FF;
+/*
+  Receive the oldest page sent to this process and map it at the page holding address R0.
+  R0 returns the sender's pid, 0xFFFF if there is no message or the page is in use.
+*/
+static inline void trecv() {
+  pthread_mutex_lock(&procLock);
+  trecvLocked();
+  pthread_mutex_unlock(&procLock);
+}
 
-  // 1. If address belongs to reserved region 
-  if (vpn < NOT_RESERVED_START_VPN) {
-    handleSegFault("Segmentation fault.");
+void trecvLocked() {
+  uint16_t vpn = reg[R0] >> VPN_SHIFT;
+  uint16_t cur_pid = curPid;
+  uint16_t ptbr = reg[PTBR];
+  struct mailbox *box = &mailboxes[cur_pid];
+  reg[R0] = INVALID_PID;
+
+  if (box->count == 0) return;
+  if (vpn < NOT_RESERVED_START_VPN || (mem[ptbr + vpn] & VALID_BIT)) {
+    printf("Cannot receive a page at page %hu of pid %hu.\n", vpn, cur_pid);
+    return;
   }
 
-  // 2. Get PTE using VPN and PTBR. Then check valid bit
-  uint16_t pte = mem[reg[PTBR] + vpn];
-  if (!(pte & VALID_BIT)) {
-    handleSegFault("Segmentation fault inside free space.");
+  // The message's reference becomes the receiver's PTE
+  struct message *msg = &box->msgs[box->head];
+  box->head = (box->head + 1) % MAILBOX_SIZE;
+  box->count--;
+  mem[ptbr + vpn] = (msg->pfn << PFN_SHIFT) | msg->perm | VALID_BIT;
+  updatePageMap(ptbr, vpn);
+  reg[R0] = msg->sender;
+}
+
+/* Terminate the process that faulted and schedule the next one */
+void reapFault() {
+  faultPending = false;
+
+  uint16_t cur_pid = curPid;
+  printf("Process %hu terminated by a fault at address 0x%.04x (pc 0x%.04x).\n", cur_pid, faultRecord.address, faultRecord.pc);
+
+  exitProc(EXIT_FAULTED);
+  dispatch();   // Load the next runnable process or let the CPU go idle
+}
+
+// Instructions to modify
+static inline void thalt() {
+  exitProc(EXIT_HALTED);
+  dispatch();   // Load the next runnable process or let the CPU go idle
+}
+
+static inline uint16_t mr(uint16_t address) {
+  // Translate through the page map: NULL means reserved, invalid or not readable
+  uint16_t *frame = rmap[address >> VPN_SHIFT];
+  if (frame == NULL) {
+    accessFault(address, false);
+    return SEG_FAULT_OUTPUT;
   }
+  return frame[address & 0x07FF];
+}
 
-  // 3. Check if write is allowed
-  if (!(pte & WRITE_BIT)) {
-    handleSegFault("Cannot write to a read-only page.");
+static inline void mw(uint16_t address, uint16_t val) {
+  // Translate through the page map: NULL means reserved, invalid, not writable or not dirty yet
+  uint16_t *frame = wmap[address >> VPN_SHIFT];
+  if (frame == NULL && (frame = accessFault(address, true)) == NULL) {
+    return;
   }
+  frame[address & 0x07FF] = val;
+}
 
-  // 4. Finally read the value from memory
-  // Compute the physical address using PFN and offset
-  uint16_t pfn = (pte >> PFN_SHIFT) & PFN_MASK;
-  uint16_t physicalAddress = pfn * PAGE_SIZE_IN_WORDS + offset;
+// Print how every process terminated, in the order they did. Call once the CPUs are stopped.
+void printExitRecords() {
+  printf("Exit records:\n");
+  for (int i = 0; i < exitCount && i < EXIT_LOG_SIZE; i++) {
+    struct exit_record *rec = &exitRecords[i];
+    if (rec->status == EXIT_FAULTED) {
+      printf("Process %hu faulted (%s) at address 0x%.04x, pc 0x%.04x.\n", rec->pid, faultNames[rec->fault], rec->address, rec->pc);
+    }
+    else {
+      printf("Process %hu halted.\n", rec->pid);
+    }
+  }
+  if (exitCount > EXIT_LOG_SIZE) {
+    printf("%d more processes terminated.\n", exitCount - EXIT_LOG_SIZE);
+  }
+}
 
-  mem[physicalAddress] = val;
+// Take the reference copy of physical memory that the next diff is taken against
+void snapshotMem() {
+  memcpy(memSnapshot, mem, sizeof(memSnapshot));
+  __atomic_store_n(&dirtyFrames, 0, __ATOMIC_RELAXED);
+}
+
+// Frames that may differ from the snapshot, bit i standing for frame i
+uint32_t changedFrames() {
+  uint32_t dirty = __atomic_load_n(&dirtyFrames, __ATOMIC_RELAXED) | OS_FRAMES;
+  uint32_t frames = 0;
+  for (uint16_t pfn = 0; pfn < FRAME_COUNT; pfn++) {
+    if (dirty & FRAME_BIT(pfn)) frames |= (uint32_t)1 << pfn;
+  }
+  return frames;
 }
 
 // YOUR CODE ENDS HERE
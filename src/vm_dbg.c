@@ -34,6 +34,61 @@ void fprintf_mem_nonzero(FILE *f, uint16_t *mem, uint32_t stop) {
     }
 }
 
+/*
+  Write the words that differ between old and mem, only looking at the frames set in
+  frames (bit i is frame i). The lines are formatted by hand into a local buffer so
+  a large diff costs a handful of fwrite calls instead of a few fprintf calls per word.
+*/
+void fprintf_mem_diff(FILE *f, uint16_t *mem, uint16_t *old, uint32_t frames, uint16_t frame_size) {
+    static const char hex[] = "0123456789abcdef";
+    char buf[1 << 16];
+    size_t len = 0;
+    for (uint32_t pfn = 0; pfn < 32; pfn++) {
+        if (!(frames & ((uint32_t)1 << pfn))) continue;
+        for (uint32_t i = pfn * frame_size; i < (pfn + 1) * frame_size; i++) {
+            if (mem[i] == old[i]) continue;
+            if (len + 64 > sizeof(buf)) {
+                fwrite(buf, 1, len, f);
+                len = 0;
+            }
+            // mem[0x1234]=0xabcd (was 0xabcd)
+            uint16_t words[3] = {(uint16_t)i, mem[i], old[i]};
+            const char *parts[3] = {"mem[0x", "]=0x", " (was 0x"};
+            for (int w = 0; w < 3; w++) {
+                for (const char *c = parts[w]; *c; c++) buf[len++] = *c;
+                for (int shift = 12; shift >= 0; shift -= 4) buf[len++] = hex[(words[w] >> shift) & 0xF];
+            }
+            buf[len++] = ')';
+            buf[len++] = '\n';
+        }
+    }
+    fwrite(buf, 1, len, f);
+}
+
+/*
+  Binary form of fprintf_mem_diff. The file holds the magic "LC3D", a uint32_t record
+  count and then one (address, new value, old value) triple of uint16_t per changed
+  word, all in host byte order like the image files.
+*/
+void fwrite_mem_diff(FILE *f, uint16_t *mem, uint16_t *old, uint32_t frames, uint16_t frame_size) {
+    uint32_t count = 0;
+    fwrite("LC3D", 1, 4, f);
+    long count_pos = ftell(f);
+    fwrite(&count, sizeof(count), 1, f);
+    for (uint32_t pfn = 0; pfn < 32; pfn++) {
+        if (!(frames & ((uint32_t)1 << pfn))) continue;
+        for (uint32_t i = pfn * frame_size; i < (pfn + 1) * frame_size; i++) {
+            if (mem[i] == old[i]) continue;
+            uint16_t rec[3] = {(uint16_t)i, mem[i], old[i]};
+            fwrite(rec, sizeof(uint16_t), 3, f);
+            count++;
+        }
+    }
+    fseek(f, count_pos, SEEK_SET);
+    fwrite(&count, sizeof(count), 1, f);
+    fseek(f, 0, SEEK_END);
+}
+
 void fprintf_reg(FILE *f, uint16_t *reg, int idx) {
     fprintf(stdout, "reg[%d]=0x%.04x\n", idx, reg[idx]);
 }
@@ -0,0 +1,180 @@
+// EVENT TRACING
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+  Machine events go into a fixed-size ring buffer that is allocated up front.
+  Recording one is a clock read and a few stores, with no allocation or formatting.
+  The newest TRACE_SIZE events are written out in the Chrome trace-event format
+  (chrome://tracing, Perfetto) when the VM exits or gets SIGINT/SIGTERM. The dump only
+  uses open/write and formats by hand, so it is safe to run from the signal handler.
+*/
+#define TRACE_SIZE (1 << 16)  // Must be a power of two
+
+enum trace_type {
+    TRACE_RUN_BEGIN = 0,  // A process starts running on a CPU
+    TRACE_RUN_END,        // A process stops running on a CPU
+    TRACE_TRAP,           // arg0: trap vector
+    TRACE_BRK,            // arg0: brk request
+    TRACE_ALLOC,          // arg0: vpn, arg1: pfn
+    TRACE_FREE,           // arg0: vpn, arg1: pfn
+    TRACE_FAULT,          // arg0: fault type, arg1: address
+    TRACE_TYPES
+};
+
+struct trace_rec {
+    uint64_t ns;
+    uint16_t type;
+    uint16_t cpu;
+    uint16_t pid;
+    uint16_t arg0;
+    uint16_t arg1;
+};
+
+static const char *trace_names[TRACE_TYPES] = {"run", "run", "trap", "brk", "alloc", "free", "fault"};
+static const char *trace_args[TRACE_TYPES][2] = {
+    {NULL, NULL}, {NULL, NULL}, {"vector", NULL}, {"request", NULL},
+    {"vpn", "pfn"}, {"vpn", "pfn"}, {"type", "address"}
+};
+
+struct trace_rec trace_buf[TRACE_SIZE];
+uint64_t trace_next = 0;     // Total number of events recorded, updated atomically
+int trace_on = 0;            // Read by every CPU and cleared by the signal handler, accessed atomically
+int trace_dumping = 0;       // Set by whoever writes the trace first, exit or a signal
+const char *trace_path = NULL;
+
+static inline uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline void trace_event(uint16_t type, uint16_t cpu, uint16_t pid, uint16_t arg0, uint16_t arg1) {
+    if (!__atomic_load_n(&trace_on, __ATOMIC_RELAXED)) return;
+    uint64_t n = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    struct trace_rec *r = &trace_buf[n & (TRACE_SIZE - 1)];
+    r->ns = trace_now();
+    r->type = type;
+    r->cpu = cpu;
+    r->pid = pid;
+    r->arg0 = arg0;
+    r->arg1 = arg1;
+}
+
+// Output buffer of trace_dump. Filling it needs no allocation or stdio.
+struct trace_out {
+    int fd;
+    size_t len;
+    char buf[1 << 14];
+};
+
+static void trace_flush(struct trace_out *o) {
+    for (size_t off = 0; off < o->len; ) {
+        ssize_t n = write(o->fd, o->buf + off, o->len - off);
+        if (n <= 0) break;
+        off += n;
+    }
+    o->len = 0;
+}
+
+static void trace_puts(struct trace_out *o, const char *s) {
+    for (; *s; s++) {
+        if (o->len == sizeof(o->buf)) trace_flush(o);
+        o->buf[o->len++] = *s;
+    }
+}
+
+// Decimal, zero padded to at least digits digits
+static void trace_putu(struct trace_out *o, uint64_t v, int digits) {
+    char tmp[21];
+    int n = sizeof(tmp) - 1;
+    tmp[n] = '\0';
+    do {
+        tmp[--n] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0 || (int)sizeof(tmp) - 1 - n < digits);
+    trace_puts(o, tmp + n);
+}
+
+void trace_dump(const char *path) {
+    struct trace_out o;
+    o.len = 0;
+    o.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (o.fd < 0) {
+        o.fd = STDERR_FILENO;
+        trace_puts(&o, "Cannot write trace to file ");
+        trace_puts(&o, path);
+        trace_puts(&o, ".\n");
+        trace_flush(&o);
+        return;
+    }
+
+    uint64_t end = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+    uint64_t begin = end > TRACE_SIZE ? end - TRACE_SIZE : 0;
+    uint64_t t0 = end > begin ? trace_buf[begin & (TRACE_SIZE - 1)].ns : 0;
+
+    trace_puts(&o, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (uint64_t n = begin; n < end; n++) {
+        struct trace_rec *r = &trace_buf[n & (TRACE_SIZE - 1)];
+        uint64_t ns = r->ns - t0;
+        trace_puts(&o, n == begin ? "{\"ts\":" : ",\n{\"ts\":");
+        trace_putu(&o, ns / 1000, 1);   // Microseconds with three decimals
+        trace_puts(&o, ".");
+        trace_putu(&o, ns % 1000, 3);
+        trace_puts(&o, ",\"pid\":0,\"tid\":");
+        trace_putu(&o, r->cpu, 1);
+        if (r->type == TRACE_RUN_BEGIN || r->type == TRACE_RUN_END) {
+            trace_puts(&o, r->type == TRACE_RUN_BEGIN ? ",\"ph\":\"B\",\"name\":\"pid " : ",\"ph\":\"E\",\"name\":\"pid ");
+            trace_putu(&o, r->pid, 1);
+            trace_puts(&o, "\"}");
+            continue;
+        }
+        trace_puts(&o, ",\"ph\":\"i\",\"s\":\"t\",\"name\":\"");
+        trace_puts(&o, trace_names[r->type]);
+        trace_puts(&o, "\",\"args\":{\"pid\":");
+        trace_putu(&o, r->pid, 1);
+        uint16_t args[2] = {r->arg0, r->arg1};
+        for (int a = 0; a < 2; a++) {
+            if (!trace_args[r->type][a]) continue;
+            trace_puts(&o, ",\"");
+            trace_puts(&o, trace_args[r->type][a]);
+            trace_puts(&o, "\":");
+            trace_putu(&o, args[a], 1);
+        }
+        trace_puts(&o, "}}");
+    }
+    trace_puts(&o, "\n]}\n");
+    trace_flush(&o);
+    close(o.fd);
+}
+
+static void trace_at_exit() {
+    if (!__atomic_exchange_n(&trace_dumping, 1, __ATOMIC_SEQ_CST)) trace_dump(trace_path);
+}
+
+/*
+  The other CPUs keep running while the handler dumps, but recording stops first, so
+  only an event that a CPU is in the middle of storing can come out torn. If exit() is
+  already writing the trace, return and let it finish.
+*/
+static void trace_on_signal(int sig) {
+    __atomic_store_n(&trace_on, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&trace_dumping, 1, __ATOMIC_SEQ_CST)) return;
+    trace_dump(trace_path);
+    _exit(128 + sig);
+}
+
+// Start recording and write the trace to path on exit or on SIGINT/SIGTERM
+void trace_start(const char *path) {
+    trace_path = path;
+    __atomic_store_n(&trace_on, 1, __ATOMIC_SEQ_CST);
+    atexit(trace_at_exit);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
@@ -0,0 +1,8 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "vm_trace.c"
+void trace_start(const char *path);
+static inline void trace_event(uint16_t type, uint16_t cpu, uint16_t pid, uint16_t arg0, uint16_t arg1);
+void trace_dump(const char *path);